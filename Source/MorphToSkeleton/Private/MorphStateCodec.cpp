@@ -0,0 +1,310 @@
+// 2024 Calming Current Games
+
+
+#include "MorphStateCodec.h"
+#include "Engine/SkeletalMesh.h"
+#include "Animation/MorphTarget.h"
+#include "Serialization/MemoryWriter.h"
+#include "Serialization/MemoryReader.h"
+#include "Misc/Crc.h"
+
+namespace
+{
+	// Same byte layout as FArchive::SerializeIntPacked: 7 bits per byte, low bit set when more bytes follow
+	void WritePackedUInt32(FArchive& Ar, uint32 Value)
+	{
+		do
+		{
+			uint8 NextByte = (uint8)((Value & 0x7f) << 1);
+			Value >>= 7;
+			if (Value > 0)
+			{
+				NextByte |= 1;
+			}
+			Ar << NextByte;
+		} while (Value > 0);
+	}
+
+	// Unlike FArchive::SerializeIntPacked this never reads past the end of the data and never takes more than 5 bytes,
+	// so truncated or hostile blobs can't make it loop or shift out of range
+	bool ReadPackedUInt32(FArchive& Ar, uint32& OutValue)
+	{
+		OutValue = 0;
+		for (int32 ByteIndex = 0; ByteIndex < 5; ++ByteIndex)
+		{
+			if (Ar.Tell() >= Ar.TotalSize())
+			{
+				return false;
+			}
+
+			uint8 NextByte = 0;
+			Ar << NextByte;
+			const uint32 Bits = NextByte >> 1;
+
+			// The fifth byte only has room for the top 4 bits of a uint32
+			if (ByteIndex == 4 && Bits > 0xf)
+			{
+				return false;
+			}
+
+			OutValue |= Bits << (7 * ByteIndex);
+			if ((NextByte & 1) == 0)
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+}
+
+TArray<uint8> FMorphStateCodec::Encode(const TArray<FMorphStateEntry>& Entries, uint32 MorphLayoutHash, bool bHighPrecision)
+{
+	for (const FMorphStateEntry& Entry : Entries)
+	{
+		if (Entry.Handle < 0)
+		{
+			UE_LOG(LogTemp, Error, TEXT("Cannot encode morph state with invalid morph target handle: %d"), Entry.Handle);
+			return TArray<uint8>();
+		}
+		if (!FMath::IsFinite(Entry.Weight) || FMath::Abs(Entry.Weight) > MaxWeight)
+		{
+			UE_LOG(LogTemp, Error, TEXT("Cannot encode morph weight %f for handle %d, weights are limited to +-%d."), Entry.Weight, Entry.Handle, MaxWeight);
+			return TArray<uint8>();
+		}
+	}
+
+	// Stable sort keeps duplicates in input order, so the first weight given for a handle wins
+	TArray<FMorphStateEntry> SortedEntries = Entries;
+	SortedEntries.StableSort([](const FMorphStateEntry& A, const FMorphStateEntry& B) { return A.Handle < B.Handle; });
+
+	TArray<FMorphStateEntry> UniqueEntries;
+	UniqueEntries.Reserve(SortedEntries.Num());
+	float MaxAbsWeight = 0.f;
+	for (const FMorphStateEntry& Entry : SortedEntries)
+	{
+		if (UniqueEntries.Num() > 0 && UniqueEntries.Last().Handle == Entry.Handle)
+		{
+			continue;
+		}
+		UniqueEntries.Add(Entry);
+		MaxAbsWeight = FMath::Max(MaxAbsWeight, FMath::Abs(Entry.Weight));
+	}
+
+	const int32 MaxQuantized = bHighPrecision ? MAX_int16 : MAX_int8;
+	int32 Range = FMath::Max(FMath::CeilToInt(MaxAbsWeight), 1);
+
+	// Decoded weights must land above Range - 1, otherwise encoding a decoded state would pick a smaller range
+	// and produce different bytes. If the largest weight would round down onto Range - 1, use the smaller range
+	// and let that weight saturate, which costs less than one quantization step.
+	const int32 MaxAbsQuantized = FMath::RoundToInt(MaxAbsWeight / Range * MaxQuantized);
+	if (Range > 1 && MaxAbsQuantized * Range <= MaxQuantized * (Range - 1))
+	{
+		--Range;
+	}
+	uint8 WeightRange = (uint8)Range;
+
+	// Quantize first so that entries rounding to zero don't end up in the count
+	TArray<TPair<int32, int32>> QuantizedEntries;
+	QuantizedEntries.Reserve(UniqueEntries.Num());
+	for (const FMorphStateEntry& Entry : UniqueEntries)
+	{
+		int32 Quantized = FMath::Clamp(FMath::RoundToInt(Entry.Weight / WeightRange * MaxQuantized), -MaxQuantized, MaxQuantized);
+		if (Quantized == 0)
+		{
+			continue;
+		}
+		QuantizedEntries.Emplace(Entry.Handle, Quantized);
+	}
+
+	TArray<uint8> Data;
+	FMemoryWriter Writer(Data);
+
+	uint8 EncodedVersion = Version;
+	uint8 Flags = bHighPrecision ? FlagHighPrecision : 0;
+	Writer << EncodedVersion;
+	Writer << Flags;
+	Writer << MorphLayoutHash;
+	Writer << WeightRange;
+
+	WritePackedUInt32(Writer, QuantizedEntries.Num());
+
+	int32 PreviousHandle = 0;
+	for (const TPair<int32, int32>& Entry : QuantizedEntries)
+	{
+		WritePackedUInt32(Writer, Entry.Key - PreviousHandle);
+		PreviousHandle = Entry.Key;
+
+		if (bHighPrecision)
+		{
+			int16 Quantized = (int16)Entry.Value;
+			Writer << Quantized;
+		}
+		else
+		{
+			int8 Quantized = (int8)Entry.Value;
+			Writer << Quantized;
+		}
+	}
+
+	return Data;
+}
+
+bool FMorphStateCodec::Decode(const TArray<uint8>& Data, uint32 ExpectedMorphLayoutHash, TArray<FMorphStateEntry>& OutEntries)
+{
+	OutEntries.Reset();
+
+	// Version, Flags, MorphLayoutHash, WeightRange and at least one byte of Count
+	if (Data.Num() < 8)
+	{
+		UE_LOG(LogTemp, Error, TEXT("Morph state is too small to be valid."));
+		return false;
+	}
+
+	FMemoryReader Reader(Data);
+
+	uint8 EncodedVersion = 0;
+	uint8 Flags = 0;
+	uint32 MorphLayoutHash = 0;
+	uint8 WeightRange = 0;
+	Reader << EncodedVersion;
+	Reader << Flags;
+	Reader << MorphLayoutHash;
+	Reader << WeightRange;
+
+	if (EncodedVersion != Version)
+	{
+		UE_LOG(LogTemp, Error, TEXT("Unsupported morph state version: %d"), EncodedVersion);
+		return false;
+	}
+	if (MorphLayoutHash != ExpectedMorphLayoutHash)
+	{
+		UE_LOG(LogTemp, Error, TEXT("Morph state was encoded for a different set of morph targets."));
+		return false;
+	}
+	if ((Flags & ~FlagHighPrecision) != 0)
+	{
+		UE_LOG(LogTemp, Error, TEXT("Morph state has unknown flags: %d"), Flags);
+		return false;
+	}
+	if (WeightRange == 0)
+	{
+		UE_LOG(LogTemp, Error, TEXT("Morph state has an invalid weight range."));
+		return false;
+	}
+
+	const bool bHighPrecision = (Flags & FlagHighPrecision) != 0;
+	const int32 MaxQuantized = bHighPrecision ? MAX_int16 : MAX_int8;
+
+	uint32 Count = 0;
+	const bool bReadCount = ReadPackedUInt32(Reader, Count);
+
+	// Every entry takes at least one byte of handle and one or two bytes of weight, reject counts the data can't hold
+	const int64 RemainingBytes = Reader.TotalSize() - Reader.Tell();
+	if (!bReadCount || Reader.IsError() || (int64)Count * (bHighPrecision ? 3 : 2) > RemainingBytes)
+	{
+		UE_LOG(LogTemp, Error, TEXT("Morph state is truncated."));
+		return false;
+	}
+
+	OutEntries.Reserve(Count);
+	int64 Handle = 0;
+	for (uint32 EntryIndex = 0; EntryIndex < Count; ++EntryIndex)
+	{
+		uint32 HandleDelta = 0;
+		const bool bReadHandle = ReadPackedUInt32(Reader, HandleDelta);
+		Handle += HandleDelta;
+
+		// Long handle deltas can eat into the bytes the count check reserved for the weights
+		if (!bReadHandle || Reader.TotalSize() - Reader.Tell() < (bHighPrecision ? 2 : 1))
+		{
+			UE_LOG(LogTemp, Error, TEXT("Morph state is truncated."));
+			OutEntries.Reset();
+			return false;
+		}
+
+		int32 Quantized = 0;
+		if (bHighPrecision)
+		{
+			int16 Value = 0;
+			Reader << Value;
+			Quantized = Value;
+		}
+		else
+		{
+			int8 Value = 0;
+			Reader << Value;
+			Quantized = Value;
+		}
+
+		// Handles must be strictly ascending and zero weights are never written
+		if (Reader.IsError() || Handle > MAX_int32 || (EntryIndex > 0 && HandleDelta == 0) || Quantized == 0 || FMath::Abs(Quantized) > MaxQuantized)
+		{
+			UE_LOG(LogTemp, Error, TEXT("Morph state is corrupt."));
+			OutEntries.Reset();
+			return false;
+		}
+
+		FMorphStateEntry& Entry = OutEntries.AddDefaulted_GetRef();
+		Entry.Handle = (int32)Handle;
+		// Multiply first, the product is an exact integer in float so Range * MaxQuantized / MaxQuantized gives exactly Range
+		Entry.Weight = (float)(Quantized * WeightRange) / (float)MaxQuantized;
+	}
+
+	if (!Reader.AtEnd())
+	{
+		UE_LOG(LogTemp, Error, TEXT("Morph state has trailing data."));
+		OutEntries.Reset();
+		return false;
+	}
+
+	return true;
+}
+
+uint32 FMorphStateCodec::ComputeMorphLayoutHash(const USkeletalMesh* SkeletalMesh)
+{
+	uint32 Crc = 0;
+	if (!SkeletalMesh)
+	{
+		return Crc;
+	}
+
+	// Hash UTF-8 lowercase names so the result doesn't depend on TCHAR width or FName casing
+	for (const UMorphTarget* MorphTarget : SkeletalMesh->GetMorphTargets())
+	{
+		const FString Name = MorphTarget ? MorphTarget->GetFName().ToString().ToLower() : FString();
+		FTCHARToUTF8 Utf8Name(*Name);
+		Crc = FCrc::MemCrc32(Utf8Name.Get(), Utf8Name.Length(), Crc);
+
+		// Separator so that ("ab", "c") and ("a", "bc") hash differently
+		const uint8 Separator = 0;
+		Crc = FCrc::MemCrc32(&Separator, sizeof(Separator), Crc);
+	}
+	return Crc;
+}
+
+TArray<FMorphStateEntry> FMorphStateCodec::MakeEntries(const USkeletalMesh* SkeletalMesh, const TMap<FName, float>& MorphWeights)
+{
+	TArray<FMorphStateEntry> Entries;
+	if (!SkeletalMesh)
+	{
+		return Entries;
+	}
+
+	const TArray<TObjectPtr<UMorphTarget>>& MorphTargets = SkeletalMesh->GetMorphTargets();
+	for (int32 Handle = 0; Handle < MorphTargets.Num(); ++Handle)
+	{
+		if (!MorphTargets[Handle])
+		{
+			continue;
+		}
+
+		const float* Weight = MorphWeights.Find(MorphTargets[Handle]->GetFName());
+		if (Weight && !FMath::IsNearlyZero(*Weight))
+		{
+			FMorphStateEntry& Entry = Entries.AddDefaulted_GetRef();
+			Entry.Handle = Handle;
+			Entry.Weight = *Weight;
+		}
+	}
+	return Entries;
+}
@@ -2,11 +2,13 @@
 
 
 #include "MorphToSkeletonComponent.h"
+#include "MorphStateCodec.h"
 #include "Rendering/SkeletalMeshLODRenderData.h"
 #include "RenderUtils.h"
 #include "Editor.h"
 #include "Async/ParallelFor.h"
 #include "EditorFramework/AssetImportData.h"
+#include "AnimationRuntime.h"
 
 // Static Variable Initialization
 FCriticalSection UMorphToSkeletonComponent::BoneMapMutex;
@@ -36,7 +38,7 @@ void UMorphToSkeletonComponent::BeginPlay()
 
 void UMorphToSkeletonComponent::SaveBoneWeightMap(USkeletalMeshComponent* SkeletalMeshComponent)
 {
-	USkeletalMesh* SkeletalMesh = SkeletalMeshComponent->GetSkeletalMeshAsset();
+	USkeletalMesh* SkeletalMesh = GetOriginalMesh(SkeletalMeshComponent);
 	if (!SkeletalMesh->IsValidLowLevelFast())
 	{
 		UE_LOG(LogTemp, Error, TEXT("SkeletalMesh is null."));
@@ -50,7 +52,7 @@ void UMorphToSkeletonComponent::SaveBoneWeightMap(USkeletalMeshComponent* Skelet
 		}
 	}
 
-	FSkeletalMeshLODRenderData& LODRenderData = SkeletalMeshComponent->GetSkeletalMeshAsset()->GetResourceForRendering()->LODRenderData[0];
+	FSkeletalMeshLODRenderData& LODRenderData = SkeletalMesh->GetResourceForRendering()->LODRenderData[0];
 	FSkinWeightVertexBuffer* SkinWeightBuffer = &LODRenderData.SkinWeightVertexBuffer;
 	TArray<FSkinWeightInfo> SkinWeightInfo;
 	SkinWeightBuffer->GetSkinWeights(SkinWeightInfo);
@@ -93,6 +95,14 @@ void UMorphToSkeletonComponent::SaveBoneWeightMap(USkeletalMeshComponent* Skelet
 				}
 			}
 		});
+
+	// ParallelFor fills the maps in a different order every run, sort them so the weight sums in ApplyTranslationsToSkeleton are reproducible
+	for (TPair<int32, FBoneWeightMap>& BoneWeightPair : BoneMapVertexWeights)
+	{
+		BoneWeightPair.Value.VertexWeight.KeySort(TLess<uint32>());
+	}
+	BoneMapVertexWeights.KeySort(TLess<int32>());
+
 	{
 		FScopeLock Lock(&BoneMapMutex);
 		SkeletalMeshBoneWeightMapCache.Add(SkeletalMesh, BoneMapVertexWeights);
@@ -108,7 +118,7 @@ void UMorphToSkeletonComponent::CacheTranslation(USkeletalMeshComponent* Skeleta
 		return;  // Skip morph targets with zero weight
 	}
 
-	UMorphTarget* Morph = SkeletalMeshComponent->GetSkeletalMeshAsset()->FindMorphTarget(MorphTarget);
+	UMorphTarget* Morph = GetOriginalMesh(SkeletalMeshComponent)->FindMorphTarget(MorphTarget);
 	if (!Morph)
 	{
 		return;  // Skip if the morph target is not found
@@ -263,17 +273,16 @@ void UMorphToSkeletonComponent::CacheTranslations(USkeletalMeshComponent* Skelet
 	}
 }
 
-void UMorphToSkeletonComponent::ApplyTranslationsToSkeleton(USkeletalMeshComponent* SkeletalMeshComponent)
+void UMorphToSkeletonComponent::ComputeRelativeTranslations(USkeletalMeshComponent* SkeletalMeshComponent)
 {
-	
 	for (const auto& BoneElem : CachedTotalTranslations)
 	{
 		int32 BoneIndex = BoneElem.Key;
 
 		// Retrieve vertex weight map for this bone
-		if (SkeletalMeshBoneWeightMapCache.Contains(SkeletalMeshComponent->GetSkeletalMeshAsset()))
+		if (SkeletalMeshBoneWeightMapCache.Contains(GetOriginalMesh(SkeletalMeshComponent)))
 		{
-			TMap<int32, FBoneWeightMap>& BoneWeightMap = SkeletalMeshBoneWeightMapCache[SkeletalMeshComponent->GetSkeletalMeshAsset()];
+			TMap<int32, FBoneWeightMap>& BoneWeightMap = SkeletalMeshBoneWeightMapCache[GetOriginalMesh(SkeletalMeshComponent)];
 
 			if (BoneWeightMap.Contains(BoneIndex))
 			{
@@ -346,15 +355,18 @@ void UMorphToSkeletonComponent::ApplyTranslationsToSkeleton(USkeletalMeshCompone
 			PAIRTranslatedBoneTranslations.Add(WeightedTransform);
 		}
 	}
+}
 
-	
-	
-
+void UMorphToSkeletonComponent::ApplyTranslationsToSkeleton(USkeletalMeshComponent* SkeletalMeshComponent)
+{
+	ComputeRelativeTranslations(SkeletalMeshComponent);
 
 	// Duplicate the skeletal mesh to avoid altering the original
-	if (!DuplicatedMesh || !DuplicatedMesh->IsValidLowLevelFast())
+	// Also duplicate again if a different mesh was set on the component since the last morph
+	if (!DuplicatedMesh || !DuplicatedMesh->IsValidLowLevelFast() || SkeletalMeshComponent->GetSkeletalMeshAsset() != DuplicatedMesh)
 	{
-		DuplicatedMesh = DuplicateObject(SkeletalMeshComponent->GetSkeletalMeshAsset(), nullptr);
+		OriginalMesh = SkeletalMeshComponent->GetSkeletalMeshAsset();
+		DuplicatedMesh = DuplicateObject(OriginalMesh, nullptr);
 	}
 
 	// Get the number of bones in the duplicated mesh's reference skeleton
@@ -419,6 +431,59 @@ void UMorphToSkeletonComponent::ApplyTranslationsToSkeleton(USkeletalMeshCompone
 	
 }
 
+void UMorphToSkeletonComponent::ApplyTranslationsToRefPose(USkeletalMeshComponent* SkeletalMeshComponent)
+{
+	ComputeRelativeTranslations(SkeletalMeshComponent);
+
+	// Reuse the duplicate while the component still shows it, otherwise copy the mesh it has now
+	if (!DuplicatedMesh || !DuplicatedMesh->IsValidLowLevelFast() || SkeletalMeshComponent->GetSkeletalMeshAsset() != DuplicatedMesh)
+	{
+		OriginalMesh = SkeletalMeshComponent->GetSkeletalMeshAsset();
+		DuplicatedMesh = DuplicateObject(OriginalMesh, nullptr);
+	}
+
+	// Start from the original reference pose so offsets from earlier states don't carry over
+	const FReferenceSkeleton& OriginalRefSkeleton = OriginalMesh->GetRefSkeleton();
+	DuplicatedMesh->RefSkeleton = OriginalRefSkeleton;
+
+	const TArray<FTransform>& Pose = OriginalRefSkeleton.GetRefBonePose();
+	FReferenceSkeletonModifier SkeletonModifier(DuplicatedMesh->RefSkeleton, DuplicatedMesh->Skeleton);
+
+	for (const auto& Elem : RelativeTranslations)
+	{
+		int32 BoneIndex = Elem.Key;
+
+		// The offsets are in mesh space, which is the component space of the reference pose.
+		// Rotate them into the parent's reference space instead of going through the live component,
+		// so the result doesn't depend on where the actor stands or what the animation is doing.
+		FVector Offset(Elem.Value);
+		int32 ParentBoneIndex = OriginalRefSkeleton.GetParentIndex(BoneIndex);
+		if (ParentBoneIndex != INDEX_NONE)
+		{
+			const FTransform ParentRefTransform = FAnimationRuntime::GetComponentSpaceTransformRefPose(OriginalRefSkeleton, ParentBoneIndex);
+			Offset = ParentRefTransform.InverseTransformVector(Offset);
+		}
+
+		FTransform FinalTransform = Pose[BoneIndex];
+		FinalTransform.AddToTranslation(Offset);
+
+		SkeletonModifier.UpdateRefPoseTransform(BoneIndex, FinalTransform);
+	}
+
+	DuplicatedMesh->RefSkeleton.RebuildRefSkeleton(DuplicatedMesh->Skeleton, false);
+
+	if (SkeletalMeshComponent->GetSkeletalMeshAsset() != DuplicatedMesh)
+	{
+		SkeletalMeshComponent->SetSkeletalMesh(DuplicatedMesh, true);
+		SkeletalMeshComponent->SetCPUSkinningEnabled(true, true);
+	}
+	else
+	{
+		// The component already shows the duplicate, only its reference pose changed
+		SkeletalMeshComponent->RefreshBoneTransforms();
+	}
+}
+
 
 void UMorphToSkeletonComponent::ApplyMorphTargetsToDuplicateMesh(USkeletalMeshComponent* SkeletalMeshComponent, const TMap<FName, float>& MorphTargets)
 {
@@ -440,9 +505,11 @@ void UMorphToSkeletonComponent::SetMorph(USkeletalMeshComponent* SkeletalMeshCom
 		return;
 	}
 
-	FSkeletalMeshLODRenderData& LODRenderData = SkeletalMeshComponent->GetSkeletalMeshAsset()->GetResourceForRendering()->LODRenderData[0];
+	FSkeletalMeshLODRenderData& LODRenderData = GetOriginalMesh(SkeletalMeshComponent)->GetResourceForRendering()->LODRenderData[0];
 	FSkinWeightVertexBuffer* SkinWeightBuffer = &LODRenderData.SkinWeightVertexBuffer;
 
+	AppliedMorphState.Reset();
+
 	// Checks if the MorphTarget already exists. If it does, subtract that from the new value, if not, just add a new entry.
 	float& OriginalValueRef = CachedMorphs.FindOrAdd(MorphTarget, 0.f);
 	float TranslationWeight = MorphValue - OriginalValueRef;
@@ -460,9 +527,11 @@ void UMorphToSkeletonComponent::SetMorphs(USkeletalMeshComponent* SkeletalMeshCo
 		return;
 	}
 
-	FSkeletalMeshLODRenderData& LODRenderData = SkeletalMeshComponent->GetSkeletalMeshAsset()->GetResourceForRendering()->LODRenderData[0];
+	FSkeletalMeshLODRenderData& LODRenderData = GetOriginalMesh(SkeletalMeshComponent)->GetResourceForRendering()->LODRenderData[0];
 	FSkinWeightVertexBuffer* SkinWeightBuffer = &LODRenderData.SkinWeightVertexBuffer;
 
+	AppliedMorphState.Reset();
+
 	for (const TPair<FName, float>& MorphTargetPair : MorphTargets)
 	{
 		// Checks if the MorphTarget already exists. If it does, subtract that from the new value, if not, just add a new entry.
@@ -485,6 +554,86 @@ void UMorphToSkeletonComponent::MorphToSkeleton(USkeletalMeshComponent* Skeletal
 	ApplyMorphTargetsToDuplicateMesh(SkeletalMeshComponent, MorphTargets);
 }
 
+USkeletalMesh* UMorphToSkeletonComponent::GetOriginalMesh(const USkeletalMeshComponent* SkeletalMeshComponent) const
+{
+	USkeletalMesh* SkeletalMesh = SkeletalMeshComponent->GetSkeletalMeshAsset();
+	if (SkeletalMesh && SkeletalMesh == DuplicatedMesh && OriginalMesh)
+	{
+		return OriginalMesh;
+	}
+	return SkeletalMesh;
+}
+
+void UMorphToSkeletonComponent::ResetCachedTranslations(USkeletalMeshComponent* SkeletalMeshComponent)
+{
+	SkeletalMeshComponent->ClearMorphTargets();
+
+	CachedMorphs.Empty();
+	CachedAffectedVertices.Empty();
+	CachedTotalTranslations.Empty();
+	RelativeTranslations.Empty();
+	PAIRTranslatedBoneNames.Empty();
+	PAIRTranslatedBoneTranslations.Empty();
+}
+
+TArray<uint8> UMorphToSkeletonComponent::EncodeMorphState(USkeletalMeshComponent* SkeletalMeshComponent, bool bHighPrecision) const
+{
+	if (!SkeletalMeshComponent || !SkeletalMeshComponent->GetSkeletalMeshAsset())
+	{
+		return TArray<uint8>();
+	}
+
+	const USkeletalMesh* SkeletalMesh = GetOriginalMesh(SkeletalMeshComponent);
+	return FMorphStateCodec::Encode(FMorphStateCodec::MakeEntries(SkeletalMesh, CachedMorphs), FMorphStateCodec::ComputeMorphLayoutHash(SkeletalMesh), bHighPrecision);
+}
+
+bool UMorphToSkeletonComponent::MorphToSkeletonFromEncodedState(USkeletalMeshComponent* SkeletalMeshComponent, const TArray<uint8>& EncodedState)
+{
+	if (!SkeletalMeshComponent || !SkeletalMeshComponent->GetSkeletalMeshAsset())
+	{
+		return false;
+	}
+
+	// The format is canonical, so the same bytes always mean the same skeleton
+	if (AppliedMorphState.Num() > 0 && EncodedState == AppliedMorphState && DuplicatedMesh && SkeletalMeshComponent->GetSkeletalMeshAsset() == DuplicatedMesh)
+	{
+		return true;
+	}
+
+	USkeletalMesh* SkeletalMesh = GetOriginalMesh(SkeletalMeshComponent);
+
+	TArray<FMorphStateEntry> Entries;
+	if (!FMorphStateCodec::Decode(EncodedState, FMorphStateCodec::ComputeMorphLayoutHash(SkeletalMesh), Entries))
+	{
+		return false;
+	}
+
+	// Entries are sorted by handle and a fresh TMap keeps insertion order, so the translations are
+	// always accumulated in the same order no matter which morphs were set before on this machine
+	const TArray<TObjectPtr<UMorphTarget>>& MeshMorphTargets = SkeletalMesh->GetMorphTargets();
+	TMap<FName, float> MorphTargets;
+	MorphTargets.Reserve(Entries.Num());
+	for (const FMorphStateEntry& Entry : Entries)
+	{
+		if (!MeshMorphTargets.IsValidIndex(Entry.Handle) || !MeshMorphTargets[Entry.Handle])
+		{
+			UE_LOG(LogTemp, Error, TEXT("Morph state references unknown morph target: %d"), Entry.Handle);
+			return false;
+		}
+		MorphTargets.Add(MeshMorphTargets[Entry.Handle]->GetFName(), Entry.Weight);
+	}
+
+	ResetCachedTranslations(SkeletalMeshComponent);
+	SaveBoneWeightMap(SkeletalMeshComponent);
+
+	SetMorphs(SkeletalMeshComponent, MorphTargets);
+	ApplyTranslationsToRefPose(SkeletalMeshComponent);
+	ApplyMorphTargetsToDuplicateMesh(SkeletalMeshComponent, MorphTargets);
+
+	AppliedMorphState = EncodedState;
+	return true;
+}
+
 
 
 
@@ -0,0 +1,218 @@
+// 2024 Calming Current Games
+
+
+#include "Misc/AutomationTest.h"
+#include "MorphStateCodec.h"
+#include <limits>
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+namespace MorphStateCodecTests
+{
+	constexpr uint32 LayoutHash = 0x12345678;
+
+	FMorphStateEntry MakeEntry(int32 Handle, float Weight)
+	{
+		FMorphStateEntry Entry;
+		Entry.Handle = Handle;
+		Entry.Weight = Weight;
+		return Entry;
+	}
+
+	TArray<FMorphStateEntry> MakeSampleEntries()
+	{
+		TArray<FMorphStateEntry> Entries;
+		Entries.Add(MakeEntry(40, 0.25f));
+		Entries.Add(MakeEntry(3, 1.f));
+		Entries.Add(MakeEntry(0, -0.7f));
+		Entries.Add(MakeEntry(500, 2.3f));
+		Entries.Add(MakeEntry(41, 0.05f));
+		return Entries;
+	}
+
+	// Decodes a round-trip and checks every weight landed within one quantization step of the input
+	bool TestRoundTrip(FAutomationTestBase& Test, bool bHighPrecision)
+	{
+		const TArray<FMorphStateEntry> Entries = MakeSampleEntries();
+		const TArray<uint8> Data = FMorphStateCodec::Encode(Entries, LayoutHash, bHighPrecision);
+
+		TArray<FMorphStateEntry> Decoded;
+		if (!Test.TestTrue(TEXT("Decode succeeds"), FMorphStateCodec::Decode(Data, LayoutHash, Decoded)))
+		{
+			return false;
+		}
+		Test.TestEqual(TEXT("Entry count"), Decoded.Num(), Entries.Num());
+
+		// Sample weights are within +-3
+		const float Step = 3.f / (bHighPrecision ? MAX_int16 : MAX_int8);
+		for (int32 Index = 1; Index < Decoded.Num(); ++Index)
+		{
+			Test.TestTrue(TEXT("Handles are ascending"), Decoded[Index - 1].Handle < Decoded[Index].Handle);
+		}
+		for (const FMorphStateEntry& Entry : Entries)
+		{
+			const FMorphStateEntry* Match = nullptr;
+			for (const FMorphStateEntry& DecodedEntry : Decoded)
+			{
+				if (DecodedEntry.Handle == Entry.Handle)
+				{
+					Match = &DecodedEntry;
+				}
+			}
+			if (Test.TestTrue(TEXT("Handle survives the round-trip"), Match != nullptr))
+			{
+				Test.TestTrue(TEXT("Weight within one quantization step"), FMath::Abs(Match->Weight - Entry.Weight) <= Step);
+			}
+		}
+		return true;
+	}
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FMorphStateCodecRoundTrip8BitTest, "MorphToSkeleton.MorphStateCodec.RoundTrip8Bit", EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::ProductFilter)
+bool FMorphStateCodecRoundTrip8BitTest::RunTest(const FString& Parameters)
+{
+	return MorphStateCodecTests::TestRoundTrip(*this, false);
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FMorphStateCodecRoundTrip16BitTest, "MorphToSkeleton.MorphStateCodec.RoundTrip16Bit", EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::ProductFilter)
+bool FMorphStateCodecRoundTrip16BitTest::RunTest(const FString& Parameters)
+{
+	return MorphStateCodecTests::TestRoundTrip(*this, true);
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FMorphStateCodecGoldenBytesTest, "MorphToSkeleton.MorphStateCodec.GoldenBytes", EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::ProductFilter)
+bool FMorphStateCodecGoldenBytesTest::RunTest(const FString& Parameters)
+{
+	using namespace MorphStateCodecTests;
+
+	// Every process and platform must produce exactly these bytes and decode them to exactly these floats
+	TArray<FMorphStateEntry> Entries;
+	Entries.Add(MakeEntry(7, -1.f));
+	Entries.Add(MakeEntry(2, 0.5f));
+
+	const TArray<uint8> Expected = { 0x01, 0x00, 0x78, 0x56, 0x34, 0x12, 0x01, 0x04, 0x04, 0x40, 0x0a, 0x81 };
+	const TArray<uint8> Data = FMorphStateCodec::Encode(Entries, LayoutHash, false);
+	TestTrue(TEXT("Encoded bytes match"), Data == Expected);
+
+	TArray<FMorphStateEntry> Decoded;
+	if (TestTrue(TEXT("Decode succeeds"), FMorphStateCodec::Decode(Expected, LayoutHash, Decoded)) && TestEqual(TEXT("Entry count"), Decoded.Num(), 2))
+	{
+		TestEqual(TEXT("First handle"), Decoded[0].Handle, 2);
+		TestTrue(TEXT("First weight is exact"), Decoded[0].Weight == 64.f / 127.f);
+		TestEqual(TEXT("Second handle"), Decoded[1].Handle, 7);
+		TestTrue(TEXT("Second weight is exact"), Decoded[1].Weight == -1.f);
+	}
+	return true;
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FMorphStateCodecReEncodeTest, "MorphToSkeleton.MorphStateCodec.ReEncode", EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::ProductFilter)
+bool FMorphStateCodecReEncodeTest::RunTest(const FString& Parameters)
+{
+	using namespace MorphStateCodecTests;
+
+	TArray<TArray<FMorphStateEntry>> Cases;
+	Cases.Add(MakeSampleEntries());
+	// Largest weight would round down onto Range - 1 with a range of 7 and 16 bit weights
+	Cases.Add({ MakeEntry(1, 6.00001f), MakeEntry(2, -0.3f) });
+	Cases.Add({ MakeEntry(5, 255.f), MakeEntry(6, -254.5f) });
+	Cases.Add({ MakeEntry(0, 1.f) });
+
+	for (const TArray<FMorphStateEntry>& Entries : Cases)
+	{
+		for (const bool bHighPrecision : { false, true })
+		{
+			const TArray<uint8> Data = FMorphStateCodec::Encode(Entries, LayoutHash, bHighPrecision);
+
+			TArray<FMorphStateEntry> Decoded;
+			if (TestTrue(TEXT("Decode succeeds"), FMorphStateCodec::Decode(Data, LayoutHash, Decoded)))
+			{
+				TestTrue(TEXT("Re-encoding a decoded state gives the same bytes"), FMorphStateCodec::Encode(Decoded, LayoutHash, bHighPrecision) == Data);
+			}
+		}
+	}
+	return true;
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FMorphStateCodecDropEntriesTest, "MorphToSkeleton.MorphStateCodec.DropEntries", EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::ProductFilter)
+bool FMorphStateCodecDropEntriesTest::RunTest(const FString& Parameters)
+{
+	using namespace MorphStateCodecTests;
+
+	TArray<FMorphStateEntry> Entries;
+	Entries.Add(MakeEntry(1, 0.f));
+	Entries.Add(MakeEntry(2, 0.001f));  // Below half a step at 8 bit
+	Entries.Add(MakeEntry(3, 0.f));
+	Entries.Add(MakeEntry(3, 0.8f));  // Duplicate, the first weight wins even though it is zero
+	Entries.Add(MakeEntry(4, 0.5f));
+	Entries.Add(MakeEntry(4, 200.f));  // Duplicate, must not widen the range either
+
+	const TArray<uint8> Data = FMorphStateCodec::Encode(Entries, LayoutHash, false);
+
+	TArray<FMorphStateEntry> Decoded;
+	if (TestTrue(TEXT("Decode succeeds"), FMorphStateCodec::Decode(Data, LayoutHash, Decoded)) && TestEqual(TEXT("Only one entry is kept"), Decoded.Num(), 1))
+	{
+		TestEqual(TEXT("Kept handle"), Decoded[0].Handle, 4);
+		TestTrue(TEXT("Kept weight uses a range of 1"), FMath::Abs(Decoded[0].Weight - 0.5f) <= 1.f / MAX_int8);
+	}
+	return true;
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FMorphStateCodecRejectInvalidInputTest, "MorphToSkeleton.MorphStateCodec.RejectInvalidInput", EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::ProductFilter)
+bool FMorphStateCodecRejectInvalidInputTest::RunTest(const FString& Parameters)
+{
+	using namespace MorphStateCodecTests;
+
+	AddExpectedError(TEXT("Cannot encode morph"), EAutomationExpectedErrorFlags::Contains, 4);
+
+	TestEqual(TEXT("Weight above 255 is rejected"), FMorphStateCodec::Encode({ MakeEntry(0, 255.5f) }, LayoutHash, true).Num(), 0);
+	TestEqual(TEXT("Huge weight is rejected"), FMorphStateCodec::Encode({ MakeEntry(0, -1.e30f) }, LayoutHash, true).Num(), 0);
+	TestEqual(TEXT("Non finite weight is rejected"), FMorphStateCodec::Encode({ MakeEntry(0, std::numeric_limits<float>::quiet_NaN()) }, LayoutHash, true).Num(), 0);
+	TestEqual(TEXT("Negative handle is rejected"), FMorphStateCodec::Encode({ MakeEntry(INDEX_NONE, 1.f) }, LayoutHash, true).Num(), 0);
+	return true;
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FMorphStateCodecRejectCorruptDataTest, "MorphToSkeleton.MorphStateCodec.RejectCorruptData", EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::ProductFilter)
+bool FMorphStateCodecRejectCorruptDataTest::RunTest(const FString& Parameters)
+{
+	using namespace MorphStateCodecTests;
+
+	// Every rejected blob logs why
+	AddExpectedError(TEXT("Morph state"), EAutomationExpectedErrorFlags::Contains, 0);
+
+	const TArray<uint8> Data = FMorphStateCodec::Encode(MakeSampleEntries(), LayoutHash, true);
+	TArray<FMorphStateEntry> Decoded;
+
+	TestFalse(TEXT("Layout hash mismatch is rejected"), FMorphStateCodec::Decode(Data, LayoutHash + 1, Decoded));
+
+	for (int32 Length = 0; Length < Data.Num(); ++Length)
+	{
+		TArray<uint8> Truncated = Data;
+		Truncated.SetNum(Length);
+		TestFalse(TEXT("Truncated data is rejected"), FMorphStateCodec::Decode(Truncated, LayoutHash, Decoded));
+	}
+
+	TArray<uint8> Trailing = Data;
+	Trailing.Add(0);
+	TestFalse(TEXT("Trailing data is rejected"), FMorphStateCodec::Decode(Trailing, LayoutHash, Decoded));
+
+	// Count whose continuation bit is set on the last byte of the data
+	const TArray<uint8> OpenCount = { 0x01, 0x00, 0x78, 0x56, 0x34, 0x12, 0x01, 0x01 };
+	TestFalse(TEXT("Unterminated count is rejected"), FMorphStateCodec::Decode(OpenCount, LayoutHash, Decoded));
+
+	// Count with more continuation bytes than a uint32 can hold
+	const TArray<uint8> LongCount = { 0x01, 0x00, 0x78, 0x56, 0x34, 0x12, 0x01, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00, 0x00, 0x00 };
+	TestFalse(TEXT("Overlong count is rejected"), FMorphStateCodec::Decode(LongCount, LayoutHash, Decoded));
+
+	// One entry whose handle keeps going into the bytes reserved for its weight
+	const TArray<uint8> OpenHandle = { 0x01, 0x01, 0x78, 0x56, 0x34, 0x12, 0x01, 0x02, 0x03, 0x03, 0x03 };
+	TestFalse(TEXT("Unterminated handle is rejected"), FMorphStateCodec::Decode(OpenHandle, LayoutHash, Decoded));
+
+	TArray<uint8> WrongVersion = Data;
+	WrongVersion[0] = FMorphStateCodec::Version + 1;
+	TestFalse(TEXT("Unknown version is rejected"), FMorphStateCodec::Decode(WrongVersion, LayoutHash, Decoded));
+
+	TestEqual(TEXT("Failed decodes leave no entries"), Decoded.Num(), 0);
+	return true;
+}
+
+#endif // WITH_DEV_AUTOMATION_TESTS
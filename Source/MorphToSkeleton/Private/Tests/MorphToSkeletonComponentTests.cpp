@@ -0,0 +1,128 @@
+// 2024 Calming Current Games
+
+
+#include "Misc/AutomationTest.h"
+#include "MorphToSkeletonComponent.h"
+#include "MorphStateCodec.h"
+#include "Components/SkeletalMeshComponent.h"
+#include "Engine/SkeletalMesh.h"
+#include "Animation/MorphTarget.h"
+#include "Misc/CommandLine.h"
+#include "Misc/Parse.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+namespace MorphToSkeletonComponentTests
+{
+	struct FMorphedCharacter
+	{
+		USkeletalMeshComponent* SkeletalMeshComponent = nullptr;
+		UMorphToSkeletonComponent* MorphComponent = nullptr;
+	};
+
+	// The plugin ships no content, so the mesh comes from the command line:
+	// -MorphToSkeletonTestMesh=/Game/Path/To/Mesh.Mesh with at least two morph targets
+	USkeletalMesh* LoadTestMesh()
+	{
+		FString MeshPath;
+		if (!FParse::Value(FCommandLine::Get(), TEXT("MorphToSkeletonTestMesh="), MeshPath))
+		{
+			return nullptr;
+		}
+
+		USkeletalMesh* SkeletalMesh = LoadObject<USkeletalMesh>(nullptr, *MeshPath);
+		return (SkeletalMesh && SkeletalMesh->GetMorphTargets().Num() >= 2) ? SkeletalMesh : nullptr;
+	}
+
+	FMorphedCharacter MakeCharacter(USkeletalMesh* SkeletalMesh)
+	{
+		FMorphedCharacter Character;
+		Character.SkeletalMeshComponent = NewObject<USkeletalMeshComponent>(GetTransientPackage());
+		Character.SkeletalMeshComponent->SetSkeletalMesh(SkeletalMesh);
+		Character.MorphComponent = NewObject<UMorphToSkeletonComponent>(GetTransientPackage());
+		Character.MorphComponent->PreMorphInitialize(Character.SkeletalMeshComponent);
+		return Character;
+	}
+
+	FMorphStateEntry MakeEntry(int32 Handle, float Weight)
+	{
+		FMorphStateEntry Entry;
+		Entry.Handle = Handle;
+		Entry.Weight = Weight;
+		return Entry;
+	}
+
+	// Everything must match bit for bit, not just within a tolerance
+	void TestSameSkeleton(FAutomationTestBase& Test, const TCHAR* What, FMorphedCharacter& Actual, FMorphedCharacter& Expected)
+	{
+		const TMap<int32, FVector3f>& ActualRelative = Actual.MorphComponent->GetRelativeTransforms();
+		const TMap<int32, FVector3f>& ExpectedRelative = Expected.MorphComponent->GetRelativeTransforms();
+		Test.TestEqual(FString::Printf(TEXT("%s: relative transform count"), What), ActualRelative.Num(), ExpectedRelative.Num());
+		for (const TPair<int32, FVector3f>& Elem : ExpectedRelative)
+		{
+			const FVector3f* ActualTranslation = ActualRelative.Find(Elem.Key);
+			Test.TestTrue(FString::Printf(TEXT("%s: relative transform of bone %d"), What, Elem.Key), ActualTranslation && *ActualTranslation == Elem.Value);
+		}
+
+		Test.TestTrue(FString::Printf(TEXT("%s: translated bone names"), What), Actual.MorphComponent->GetTranslatedBoneNames() == Expected.MorphComponent->GetTranslatedBoneNames());
+		Test.TestTrue(FString::Printf(TEXT("%s: translated bone translations"), What), Actual.MorphComponent->GetTranslatedBoneTranslations() == Expected.MorphComponent->GetTranslatedBoneTranslations());
+
+		const TArray<FTransform>& ActualPose = Actual.SkeletalMeshComponent->GetSkeletalMeshAsset()->GetRefSkeleton().GetRefBonePose();
+		const TArray<FTransform>& ExpectedPose = Expected.SkeletalMeshComponent->GetSkeletalMeshAsset()->GetRefSkeleton().GetRefBonePose();
+		if (Test.TestEqual(FString::Printf(TEXT("%s: bone count"), What), ActualPose.Num(), ExpectedPose.Num()))
+		{
+			for (int32 BoneIndex = 0; BoneIndex < ExpectedPose.Num(); ++BoneIndex)
+			{
+				Test.TestTrue(FString::Printf(TEXT("%s: reference pose of bone %d"), What, BoneIndex), ActualPose[BoneIndex].Equals(ExpectedPose[BoneIndex], 0.f));
+			}
+		}
+	}
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FMorphToSkeletonEncodedStateDeterminismTest, "MorphToSkeleton.Component.EncodedStateDeterminism", EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::ProductFilter)
+bool FMorphToSkeletonEncodedStateDeterminismTest::RunTest(const FString& Parameters)
+{
+	using namespace MorphToSkeletonComponentTests;
+
+	USkeletalMesh* SkeletalMesh = LoadTestMesh();
+	if (!SkeletalMesh)
+	{
+		AddWarning(TEXT("Skipped, pass -MorphToSkeletonTestMesh=<skeletal mesh with at least two morph targets> to run it."));
+		return true;
+	}
+
+	const TArray<TObjectPtr<UMorphTarget>>& MorphTargets = SkeletalMesh->GetMorphTargets();
+	const int32 LastHandle = MorphTargets.Num() - 1;
+	const uint32 LayoutHash = FMorphStateCodec::ComputeMorphLayoutHash(SkeletalMesh);
+
+	const TArray<uint8> State = FMorphStateCodec::Encode({ MakeEntry(0, 0.6f), MakeEntry(1, -0.35f) }, LayoutHash, true);
+	const TArray<uint8> OtherState = FMorphStateCodec::Encode({ MakeEntry(1, 0.9f), MakeEntry(LastHandle, 0.4f) }, LayoutHash, true);
+
+	FMorphedCharacter Fresh = MakeCharacter(SkeletalMesh);
+	TestTrue(TEXT("Fresh component applies the state"), Fresh.MorphComponent->MorphToSkeletonFromEncodedState(Fresh.SkeletalMeshComponent, State));
+
+	// Live morphs set in another order and partly overwritten, then morphed through the live path
+	FMorphedCharacter LiveHistory = MakeCharacter(SkeletalMesh);
+	LiveHistory.MorphComponent->SetMorph(LiveHistory.SkeletalMeshComponent, MorphTargets[1]->GetFName(), 0.9f);
+	LiveHistory.MorphComponent->SetMorph(LiveHistory.SkeletalMeshComponent, MorphTargets[LastHandle]->GetFName(), 1.f);
+	LiveHistory.MorphComponent->SetMorph(LiveHistory.SkeletalMeshComponent, MorphTargets[1]->GetFName(), 0.1f);
+	LiveHistory.MorphComponent->MorphToSkeleton(LiveHistory.SkeletalMeshComponent, { { MorphTargets[0]->GetFName(), -0.2f } });
+	TestTrue(TEXT("Component with live morphs applies the state"), LiveHistory.MorphComponent->MorphToSkeletonFromEncodedState(LiveHistory.SkeletalMeshComponent, State));
+	TestSameSkeleton(*this, TEXT("After live morphs"), LiveHistory, Fresh);
+
+	// Another state first, so the component already shows a modified duplicate
+	FMorphedCharacter StateHistory = MakeCharacter(SkeletalMesh);
+	TestTrue(TEXT("Component applies the other state"), StateHistory.MorphComponent->MorphToSkeletonFromEncodedState(StateHistory.SkeletalMeshComponent, OtherState));
+	USkeletalMesh* FirstDuplicate = StateHistory.SkeletalMeshComponent->GetSkeletalMeshAsset();
+	TestTrue(TEXT("Component with another state applies the state"), StateHistory.MorphComponent->MorphToSkeletonFromEncodedState(StateHistory.SkeletalMeshComponent, State));
+	TestTrue(TEXT("The duplicate is reused"), StateHistory.SkeletalMeshComponent->GetSkeletalMeshAsset() == FirstDuplicate);
+	TestSameSkeleton(*this, TEXT("After another state"), StateHistory, Fresh);
+
+	// Applying the same bytes again must not change anything
+	TestTrue(TEXT("Reapplying the state succeeds"), StateHistory.MorphComponent->MorphToSkeletonFromEncodedState(StateHistory.SkeletalMeshComponent, State));
+	TestSameSkeleton(*this, TEXT("After reapplying"), StateHistory, Fresh);
+
+	return true;
+}
+
+#endif // WITH_DEV_AUTOMATION_TESTS
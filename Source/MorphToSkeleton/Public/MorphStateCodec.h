@@ -0,0 +1,57 @@
+// 2024 Calming Current Games
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "MorphStateCodec.generated.h"
+
+class USkeletalMesh;
+
+// A single non-zero morph weight, keyed by the morph target's index in the skeletal mesh
+USTRUCT()
+struct FMorphStateEntry
+{
+	GENERATED_BODY()
+
+	int32 Handle = INDEX_NONE;
+
+	float Weight = 0.f;
+};
+
+/**
+ * Compact, versioned encoding of a morph weight vector.
+ *
+ * Layout (little endian):
+ *   uint8  Version
+ *   uint8  Flags            (bit 0 set = 16 bit weights, otherwise 8 bit)
+ *   uint32 MorphLayoutHash  (CRC of the mesh's morph target names, rejects blobs made for another mesh)
+ *   uint8  WeightRange      (weights are quantized in [-WeightRange, WeightRange])
+ *   packed Count
+ *   Count x { packed HandleDelta, int8/int16 QuantizedWeight }
+ *
+ * Handles are written in ascending order so that decoding always yields the same sorted vector.
+ * WeightRange is stored in a byte, so weights are limited to +-255.
+ */
+class MORPHTOSKELETON_API FMorphStateCodec
+{
+public:
+	static constexpr uint8 Version = 1;
+
+	static constexpr int32 MaxWeight = 255;
+
+	// Encode the entries. Entries whose weight quantizes to zero are dropped, and the first weight wins if a handle appears twice.
+	// Returns an empty array if a handle is negative or a weight is not finite or outside +-MaxWeight.
+	static TArray<uint8> Encode(const TArray<FMorphStateEntry>& Entries, uint32 MorphLayoutHash, bool bHighPrecision);
+
+	// Decode a blob produced by Encode. Returns false if the blob is malformed, from another version, or made for another morph layout.
+	static bool Decode(const TArray<uint8>& Data, uint32 ExpectedMorphLayoutHash, TArray<FMorphStateEntry>& OutEntries);
+
+	// Hash of the morph target names of a mesh, in handle order
+	static uint32 ComputeMorphLayoutHash(const USkeletalMesh* SkeletalMesh);
+
+	// Convert name keyed morph weights to handle keyed entries for the given mesh. Unknown morph targets are skipped.
+	static TArray<FMorphStateEntry> MakeEntries(const USkeletalMesh* SkeletalMesh, const TMap<FName, float>& MorphWeights);
+
+private:
+	static constexpr uint8 FlagHighPrecision = 1 << 0;
+};
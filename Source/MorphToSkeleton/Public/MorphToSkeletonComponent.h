@@ -33,8 +33,14 @@ private:
 
 protected:
 
+	// Runtime copy of OriginalMesh whose reference pose we modify, never saved with the component
+	UPROPERTY(Transient)
 	USkeletalMesh* DuplicatedMesh;
 
+	// The mesh DuplicatedMesh was copied from, with an unmodified reference pose
+	UPROPERTY(Transient)
+	USkeletalMesh* OriginalMesh;
+
 
 	// Stores morphs already applied in CachedTotalTranslations
 	TMap<FName, float> CachedMorphs;
@@ -52,6 +58,9 @@ protected:
 	TArray<FName> PAIRTranslatedBoneNames;
 	TArray<FVector3f> PAIRTranslatedBoneTranslations;
 
+	// Last blob applied with MorphToSkeletonFromEncodedState, cleared when morphs are set any other way
+	TArray<uint8> AppliedMorphState;
+
 
 
 protected:
@@ -66,12 +75,24 @@ protected:
 
 	void CacheTranslations(USkeletalMeshComponent* SkeletalMeshComponent, TMap<FName, float> MorphTargets);
 
+	// Turn the Cached Translations into per bone offsets relative to the parent bone
+	void ComputeRelativeTranslations(USkeletalMeshComponent* SkeletalMeshComponent);
+
 	// Apply the Cached Translations to the skeleton
 	void ApplyTranslationsToSkeleton(USkeletalMeshComponent* SkeletalMeshComponent);
 
+	// Apply the Cached Translations on top of the original reference pose, without using the component's live transforms
+	void ApplyTranslationsToRefPose(USkeletalMeshComponent* SkeletalMeshComponent);
+
 	// Apply the mesh morphs to the duplicate mesh that we created.
 	void ApplyMorphTargetsToDuplicateMesh(USkeletalMeshComponent* SkeletalMeshComponent, const TMap<FName, float>& MorphTargets);
 
+	// The mesh the component had before we swapped in DuplicatedMesh
+	USkeletalMesh* GetOriginalMesh(const USkeletalMeshComponent* SkeletalMeshComponent) const;
+
+	// Clear the component's morph targets and all cached morphs and translations
+	void ResetCachedTranslations(USkeletalMeshComponent* SkeletalMeshComponent);
+
 public:
 	// Call to Store information about the mesh you are morphing
 	UFUNCTION(BlueprintCallable, Category = "MorphToSkeleton")
@@ -88,6 +109,16 @@ public:
 	UFUNCTION(BlueprintCallable, Category = "MorphToSkeleton")
 	void MorphToSkeleton(USkeletalMeshComponent* SkeletalMeshComponent, TMap<FName, float> MorphTargets);
 
+	// Encode the current morph weights into a compact blob for savegames and network snapshots.
+	// 16 bit weights are used when bHighPrecision is set, 8 bit otherwise.
+	UFUNCTION(BlueprintCallable, Category = "MorphToSkeleton|Serialization")
+	TArray<uint8> EncodeMorphState(USkeletalMeshComponent* SkeletalMeshComponent, bool bHighPrecision = true) const;
+
+	// Decode a blob from EncodeMorphState and rebuild the skeleton from it on top of the original reference pose.
+	// The bone offsets only depend on the blob and the mesh, so every machine ends up with the same skeleton.
+	// Applying the same blob again does nothing. The owner should apply its own blob as well to match what everyone else sees.
+	UFUNCTION(BlueprintCallable, Category = "MorphToSkeleton|Serialization")
+	bool MorphToSkeletonFromEncodedState(USkeletalMeshComponent* SkeletalMeshComponent, const TArray<uint8>& EncodedState);
 
 	UFUNCTION(BlueprintCallable, Category = "MorphToSkeleton")
 	const TMap<int32, FVector3f>& GetRelativeTransforms() { return RelativeTranslations; }